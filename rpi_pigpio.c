@@ -9,6 +9,22 @@
 #include <time.h>
 #include <gpiod.h>
 
+// SIMD sync word search. 64-bit Pi OS (AArch64) always has NEON. 32-bit
+// Pi OS (armhf) compilers default to ARMv6 without NEON, so on a Pi 2 or
+// later build with
+//   gcc -O2 -march=armv7-a -mfpu=neon-vfpv4 -o rpi_pigpio rpi_pigpio.c -lgpiod
+// Otherwise (and on the Pi Zero/1) the search falls back to the scalar loop,
+// which is reported at startup.
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SYNC_SEARCH     "NEON"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SYNC_SEARCH     "SSE2"
+#else
+#define SYNC_SEARCH     "scalar"
+#endif
+
 // Configuration
 #define SPI_DEVICE      "/dev/spidev0.0"
 #define BUFFER_SIZE     4096          // Number of 32-bit elements
@@ -18,18 +34,107 @@
 #define GPIO_CHIP       "/dev/gpiochip0"
 #define DATA_READY_PIN  25            // GPIO pin for data ready
 
+// Framed stream mode (--framed)
+// Frame layout (little-endian): sync word (4), sequence (2), element count (2),
+// payload (count * 4), checksum (4). The receiver scans for the sync word, so a
+// dropped or extra byte on the wire costs only the frames it touches.
+#define FRAME_SYNC_WORD     0x5AA5C33Cu   // On the wire: 3C C3 A5 5A
+#define FRAME_HEADER_BYTES  8
+#define FRAME_TRAILER_BYTES 4
+#define FRAME_MAX_ELEMS     BUFFER_SIZE
+#define FRAME_MAX_BYTES     (FRAME_HEADER_BYTES + FRAME_MAX_ELEMS * BYTES_PER_ELEM + FRAME_TRAILER_BYTES)
+#define FRAME_MIN_ELEMS     64
+#define FRAME_FIT_ELEMS     ((TOTAL_BYTES - FRAME_HEADER_BYTES - FRAME_TRAILER_BYTES) / BYTES_PER_ELEM)  // Largest frame one transfer always completes
+#define STREAM_BYTES        (TOTAL_BYTES + FRAME_MAX_BYTES)  // New transfer plus a partial frame
+
+// Host-to-device commands, sent at the start of the tx buffer in framed mode
+// (the rest of the tx buffer stays zero). Layout (little-endian): sync word (4),
+// opcode (2), sequence (2), argument (2), check (2).
+#define CMD_SYNC_WORD       0xA55A3CC3u   // On the wire: C3 3C 5A A5
+#define CMD_BYTES           12
+#define CMD_ACK             0x0001        // seq = last frame received with no gap before it
+#define CMD_RETRANSMIT      0x0002        // seq = first frame to resend, arg = number of frames
+#define CMD_FRAME_SIZE      0x0003        // arg = elements per frame
+#define MAX_COMMANDS        (CHUNK_SIZE / CMD_BYTES)
+#define MAX_MISSING         (MAX_COMMANDS - 2)  // One request each, plus ACK and frame size
+#define RETX_MAX_TRIES      3             // Requests per missing frame before giving up
+#define RETX_WINDOW         64            // Frames the device keeps for retransmission
+
+// Resynchronization and retransmission bookkeeping for framed mode
+struct frame_stats {
+    unsigned long frames;         // Frames accepted
+    unsigned long bad_frames;     // Sync found but checksum failed
+    unsigned long lost_frames;    // Missing frames given up on
+    unsigned long recovered;      // Missing frames recovered by retransmission
+    unsigned long duplicates;     // Retransmitted frames that were no longer needed
+    unsigned long slipped_bytes;  // Total misalignment corrected (bytes dropped or inserted)
+    unsigned long discarded_bytes; // Bytes thrown away while searching for sync
+    unsigned long resyncs;        // Times the stream had to be realigned
+    unsigned long pending_discard; // Bytes discarded since the last good frame
+    uint64_t stream_base;         // Stream offset of the start of the stream buffer
+    uint64_t expected_start;      // Stream offset where the next frame should begin
+    int have_expected;
+    int bad_since_good;           // A frame was rejected since the last good frame
+    int have_seq;
+    uint16_t last_seq;
+    int last_count;               // Element count of the last accepted frame
+    int current_elems;            // Element count of the newest in-order frame
+    int requested_elems;          // Frame size last requested from the device (0 = none)
+    uint16_t missing[MAX_MISSING];
+    uint8_t missing_tries[MAX_MISSING];
+    int missing_count;
+    uint16_t requested[RETX_WINDOW]; // Recently requested frames, to recognise late duplicates
+    int requested_count;
+    int requested_next;
+};
+
+// Reference simulated device (--simulate)
+// Stands in for the Teensy: streams frames, obeys the host commands in the tx
+// buffer and periodically damages the wire so resync and retransmission run.
+#define SIM_DEFAULT_ELEMS   256
+#define SIM_HISTORY_FRAMES  RETX_WINDOW   // Recent frames available for retransmission
+#define SIM_MAX_RETX        32            // Queued retransmissions
+#define SIM_GLITCH_BYTES    40000         // Bytes between injected wire glitches
+
+struct sim_device {
+    uint16_t next_seq;
+    uint16_t acked_seq;
+    int have_ack;
+    int frame_elems;
+    int history_elems[SIM_HISTORY_FRAMES];  // Size of each recent frame, by seq
+    uint16_t retx_queue[SIM_MAX_RETX];
+    int retx_count;
+    uint8_t frame[FRAME_MAX_BYTES];          // Frame currently being clocked out
+    size_t frame_len;
+    size_t frame_pos;
+    unsigned long byte_count;
+    int glitch;
+};
+
+static int simulate = 0;
+static struct sim_device sim;
+
 // Function prototypes
 int setup_spi(int speed_hz);
 struct gpiod_chip* setup_gpio(void);
 void wait_for_data_ready_high(struct gpiod_chip* chip, struct gpiod_line* line);
 void wait_for_data_ready_low(struct gpiod_chip* chip, struct gpiod_line* line);
-void transfer_data(int fd, uint8_t* buffer);
+int spi_transfer(int fd, struct spi_ioc_transfer* transfer);
+void transfer_data(int fd, uint8_t* buffer, const uint8_t* commands, int command_bytes);
 void print_buffer_stats(uint8_t* buffer, uint32_t* elements);
-void convert_to_elements(uint8_t* buffer, uint32_t* elements);
-void check_pattern(uint32_t* elements);
+void convert_to_elements(uint8_t* buffer, uint32_t* elements, int count);
+void check_pattern(uint32_t* elements, int count);
+size_t find_sync_word(const uint8_t* buffer, size_t len, uint32_t sync);
+uint32_t frame_checksum(uint16_t seq, uint16_t count, const uint32_t* elements);
+int process_frames(uint8_t* stream, size_t* stream_len, uint32_t* elements,
+                   FILE* outfile, struct frame_stats* stats);
+int build_commands(uint8_t* commands, struct frame_stats* stats);
+void adjust_frame_size(struct frame_stats* stats, int link_ok);
+void sim_device_init(void);
+int sim_device_transfer(const uint8_t* tx, uint8_t* rx, size_t len);
 double get_time_diff_ms(struct timespec start, struct timespec end);
 
-int main() {
+int main(int argc, char* argv[]) {
     int spi_fd;
     uint8_t* byte_buffer;
     uint32_t* element_buffer;
@@ -37,11 +142,29 @@ int main() {
     struct gpiod_line* data_ready_line;
     struct timespec start_time, end_time;
     int transaction_count = 0;
+    int framed = 0;
+    size_t stream_len = 0;
+    struct frame_stats stats;
     
-    printf("SPI Master 32-bit Transfer Program\n");
+    // Parse arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--framed") == 0) {
+            framed = 1;
+        } else if (strcmp(argv[i], "--simulate") == 0) {
+            simulate = 1;
+            framed = 1;
+        }
+    }
+    memset(&stats, 0, sizeof(stats));
+    
+    printf("SPI Master 32-bit Transfer Program%s%s\n",
+           framed ? " (framed stream)" : "", simulate ? " - simulated device" : "");
+    if (framed) {
+        printf("Sync word search: %s\n", SYNC_SEARCH);
+    }
     
-    // Allocate memory for buffers
-    byte_buffer = (uint8_t*)malloc(TOTAL_BYTES);
+    // Allocate memory for buffers (framed mode keeps a partial frame between transfers)
+    byte_buffer = (uint8_t*)malloc(framed ? STREAM_BYTES : TOTAL_BYTES);
     element_buffer = (uint32_t*)malloc(BUFFER_SIZE * sizeof(uint32_t));
     
     if (!byte_buffer || !element_buffer) {
@@ -49,59 +172,78 @@ int main() {
         return -1;
     }
     
-    // Setup SPI (8MHz)
-    spi_fd = setup_spi(8000000);
-    if (spi_fd < 0) {
-        free(byte_buffer);
-        free(element_buffer);
-        return -1;
-    }
+    spi_fd = -1;
+    gpio_chip = NULL;
+    data_ready_line = NULL;
     
-    // Setup GPIO
-    gpio_chip = setup_gpio();
-    if (!gpio_chip) {
-        close(spi_fd);
-        free(byte_buffer);
-        free(element_buffer);
-        return -1;
-    }
+    if (simulate) {
+        sim_device_init();
+        printf("Simulated device ready\n");
+    } else {
+        // Setup SPI (8MHz)
+        spi_fd = setup_spi(8000000);
+        if (spi_fd < 0) {
+            free(byte_buffer);
+            free(element_buffer);
+            return -1;
+        }
     
-    // Get data ready line
-    data_ready_line = gpiod_chip_get_line(gpio_chip, DATA_READY_PIN);
-    if (!data_ready_line) {
-        fprintf(stderr, "Unable to get GPIO line %d\n", DATA_READY_PIN);
-        gpiod_chip_close(gpio_chip);
-        close(spi_fd);
-        free(byte_buffer);
-        free(element_buffer);
-        return -1;
-    }
+        // Setup GPIO
+        gpio_chip = setup_gpio();
+        if (!gpio_chip) {
+            close(spi_fd);
+            free(byte_buffer);
+            free(element_buffer);
+            return -1;
+        }
     
-    // Configure data ready line as input
-    if (gpiod_line_request_input(data_ready_line, "rpi_spi") < 0) {
-        fprintf(stderr, "Unable to configure GPIO line %d as input\n", DATA_READY_PIN);
-        gpiod_line_release(data_ready_line);
-        gpiod_chip_close(gpio_chip);
-        close(spi_fd);
-        free(byte_buffer);
-        free(element_buffer);
-        return -1;
-    }
+        // Get data ready line
+        data_ready_line = gpiod_chip_get_line(gpio_chip, DATA_READY_PIN);
+        if (!data_ready_line) {
+            fprintf(stderr, "Unable to get GPIO line %d\n", DATA_READY_PIN);
+            gpiod_chip_close(gpio_chip);
+            close(spi_fd);
+            free(byte_buffer);
+            free(element_buffer);
+            return -1;
+        }
     
-    printf("SPI and GPIO initialized\n");
-    printf("Waiting for data ready signal (HIGH) from Teensy...\n");
+        // Configure data ready line as input
+        if (gpiod_line_request_input(data_ready_line, "rpi_spi") < 0) {
+            fprintf(stderr, "Unable to configure GPIO line %d as input\n", DATA_READY_PIN);
+            gpiod_line_release(data_ready_line);
+            gpiod_chip_close(gpio_chip);
+            close(spi_fd);
+            free(byte_buffer);
+            free(element_buffer);
+            return -1;
+        }
+    
+        printf("SPI and GPIO initialized\n");
+        printf("Waiting for data ready signal (HIGH) from Teensy...\n");
+    
+    }
     
     // Main loop
     while (transaction_count < 10) { // Limit to 10 transactions for safety
         // Wait for data ready signal (HIGH)
-        wait_for_data_ready_high(gpio_chip, data_ready_line);
+        if (!simulate) {
+            wait_for_data_ready_high(gpio_chip, data_ready_line);
+        }
         
         transaction_count++;
         printf("\nTransaction #%d - Data ready HIGH detected\n", transaction_count);
         
-        // Transfer data
+        // Queue acknowledgements and retransmit/frame size requests for the tx buffer
+        uint8_t commands[CHUNK_SIZE];
+        int command_bytes = framed ? build_commands(commands, &stats) : 0;
+        if (command_bytes > 0) {
+            printf("Sending %d commands to device\n", command_bytes / CMD_BYTES);
+        }
+        
+        // Transfer data (framed mode appends after any partial frame left over)
         clock_gettime(CLOCK_MONOTONIC, &start_time);
-        transfer_data(spi_fd, byte_buffer);
+        transfer_data(spi_fd, byte_buffer + stream_len, commands, command_bytes);
         clock_gettime(CLOCK_MONOTONIC, &end_time);
         
         double transfer_time_ms = get_time_diff_ms(start_time, end_time);
@@ -109,40 +251,82 @@ int main() {
                transfer_time_ms, 
                (TOTAL_BYTES / 1024.0) / (transfer_time_ms / 1000.0));
         
-        // Convert bytes to 32-bit elements
-        clock_gettime(CLOCK_MONOTONIC, &start_time);
-        convert_to_elements(byte_buffer, element_buffer);
-        clock_gettime(CLOCK_MONOTONIC, &end_time);
-        printf("Conversion time: %.2f ms\n", get_time_diff_ms(start_time, end_time));
+        char filename[64];
+        sprintf(filename, "spi_data_transaction_%d.bin", transaction_count);
         
-        // Analyze buffer contents
-        print_buffer_stats(byte_buffer, element_buffer);
-        check_pattern(element_buffer);
+        if (framed) {
+            // Extract frames, realigning on the sync word instead of trusting offsets
+            FILE* outfile = fopen(filename, "wb");
+            unsigned long errors_before = stats.bad_frames + stats.resyncs;
+            stream_len += TOTAL_BYTES;
+            clock_gettime(CLOCK_MONOTONIC, &start_time);
+            int frames = process_frames(byte_buffer, &stream_len, element_buffer, outfile, &stats);
+            clock_gettime(CLOCK_MONOTONIC, &end_time);
+            printf("Extracted %d frames in %.2f ms (%zu bytes carried over)\n",
+                   frames, get_time_diff_ms(start_time, end_time), stream_len);
+            printf("Stream totals: %lu frames, %lu bad, %lu recovered, %lu lost, %d pending, "
+                   "%lu duplicates, %lu bytes slipped in %lu resyncs (%lu bytes discarded)\n",
+                   stats.frames, stats.bad_frames, stats.recovered, stats.lost_frames,
+                   stats.missing_count, stats.duplicates, stats.slipped_bytes, stats.resyncs,
+                   stats.discarded_bytes);
+            
+            // Grow frames while the link is clean, shrink them when it is not; a
+            // transfer that only carried part of a frame says nothing either way
+            int link_errors = stats.missing_count > 0 ||
+                              stats.bad_frames + stats.resyncs != errors_before;
+            if (frames > 0 || link_errors) {
+                adjust_frame_size(&stats, !link_errors);
+            }
+            if (frames > 0) {
+                check_pattern(element_buffer, stats.last_count);
+            }
+            if (outfile) {
+                fclose(outfile);
+                printf("Frame data saved to %s\n", filename);
+            }
+        } else {
+            // Convert bytes to 32-bit elements
+            printf("Converting %d bytes to %d 32-bit elements...\n", TOTAL_BYTES, BUFFER_SIZE);
+            clock_gettime(CLOCK_MONOTONIC, &start_time);
+            convert_to_elements(byte_buffer, element_buffer, BUFFER_SIZE);
+            clock_gettime(CLOCK_MONOTONIC, &end_time);
+            printf("Conversion time: %.2f ms\n", get_time_diff_ms(start_time, end_time));
+            
+            // Analyze buffer contents
+            print_buffer_stats(byte_buffer, element_buffer);
+            check_pattern(element_buffer, BUFFER_SIZE);
+        }
         
         // Wait for data ready to go low (transfer complete)
-        printf("Waiting for Teensy to signal completion (data ready LOW)...\n");
-        wait_for_data_ready_low(gpio_chip, data_ready_line);
-        printf("Data ready LOW - transfer complete\n");
+        if (!simulate) {
+            printf("Waiting for Teensy to signal completion (data ready LOW)...\n");
+            wait_for_data_ready_low(gpio_chip, data_ready_line);
+            printf("Data ready LOW - transfer complete\n");
+        }
         
         // Save data to file if needed
-        char filename[64];
-        sprintf(filename, "spi_data_transaction_%d.bin", transaction_count);
-        FILE* outfile = fopen(filename, "wb");
-        if (outfile) {
-            fwrite(element_buffer, sizeof(uint32_t), BUFFER_SIZE, outfile);
-            fclose(outfile);
-            printf("Data saved to %s\n", filename);
+        if (!framed) {
+            FILE* outfile = fopen(filename, "wb");
+            if (outfile) {
+                fwrite(element_buffer, sizeof(uint32_t), BUFFER_SIZE, outfile);
+                fclose(outfile);
+                printf("Data saved to %s\n", filename);
+            }
         }
         
         printf("Ready for next transaction\n");
-        sleep(1);
+        if (!simulate) {
+            sleep(1);
+        }
     }
     
     // Cleanup
     printf("Cleaning up...\n");
-    gpiod_line_release(data_ready_line);
-    gpiod_chip_close(gpio_chip);
-    close(spi_fd);
+    if (!simulate) {
+        gpiod_line_release(data_ready_line);
+        gpiod_chip_close(gpio_chip);
+        close(spi_fd);
+    }
     free(byte_buffer);
     free(element_buffer);
     
@@ -243,8 +427,17 @@ void wait_for_data_ready_low(struct gpiod_chip* chip, struct gpiod_line* line) {
     printf("WARNING: Timeout waiting for data ready LOW\n");
 }
 
-// Transfer data in chunks
-void transfer_data(int fd, uint8_t* buffer) {
+// Run one SPI message on the device, or on the simulated device with --simulate
+int spi_transfer(int fd, struct spi_ioc_transfer* transfer) {
+    if (simulate) {
+        return sim_device_transfer((const uint8_t*)(uintptr_t)transfer->tx_buf,
+                                   (uint8_t*)(uintptr_t)transfer->rx_buf, transfer->len);
+    }
+    return ioctl(fd, SPI_IOC_MESSAGE(1), transfer);
+}
+
+// Transfer data in chunks, sending any host commands at the start of the first chunk
+void transfer_data(int fd, uint8_t* buffer, const uint8_t* commands, int command_bytes) {
     struct spi_ioc_transfer transfer;
     uint8_t tx_buffer[CHUNK_SIZE];
     uint8_t rx_buffer[CHUNK_SIZE];
@@ -257,8 +450,11 @@ void transfer_data(int fd, uint8_t* buffer) {
     printf("Transferring %d bytes in %d chunks of %d bytes plus %d bytes\n",
            TOTAL_BYTES, chunks, CHUNK_SIZE, remainder);
     
-    // Zero-fill the transmit buffer
+    // Zero-fill the transmit buffer and place the commands (at most one chunk)
     memset(tx_buffer, 0, CHUNK_SIZE);
+    if (command_bytes > 0) {
+        memcpy(tx_buffer, commands, command_bytes < CHUNK_SIZE ? command_bytes : CHUNK_SIZE);
+    }
     
     // Process full chunks
     for (i = 0; i < chunks; i++) {
@@ -275,7 +471,7 @@ void transfer_data(int fd, uint8_t* buffer) {
         
         // Transfer data
         clock_gettime(CLOCK_MONOTONIC, &chunk_start);
-        if (ioctl(fd, SPI_IOC_MESSAGE(1), &transfer) < 0) {
+        if (spi_transfer(fd, &transfer) < 0) {
             perror("SPI transfer failed");
             return;
         }
@@ -285,6 +481,11 @@ void transfer_data(int fd, uint8_t* buffer) {
         memcpy(buffer + bytes_transferred, rx_buffer, chunk_size);
         bytes_transferred += chunk_size;
         
+        // Commands go out once; later chunks clock out zeros
+        if (i == 0 && command_bytes > 0) {
+            memset(tx_buffer, 0, CHUNK_SIZE);
+        }
+        
         // Report progress
         if (i == 0 || i == chunks-1 || i % 16 == 0) {
             double chunk_time_ms = get_time_diff_ms(chunk_start, chunk_end);
@@ -323,7 +524,7 @@ void transfer_data(int fd, uint8_t* buffer) {
         transfer.bits_per_word = 8;
         
         // Transfer data
-        if (ioctl(fd, SPI_IOC_MESSAGE(1), &transfer) < 0) {
+        if (spi_transfer(fd, &transfer) < 0) {
             perror("SPI transfer failed");
             return;
         }
@@ -337,11 +538,10 @@ void transfer_data(int fd, uint8_t* buffer) {
 }
 
 // Convert bytes to 32-bit elements
-void convert_to_elements(uint8_t* buffer, uint32_t* elements) {
+void convert_to_elements(uint8_t* buffer, uint32_t* elements, int count) {
     int i;
-    printf("Converting %d bytes to %d 32-bit elements...\n", TOTAL_BYTES, BUFFER_SIZE);
     
-    for (i = 0; i < BUFFER_SIZE; i++) {
+    for (i = 0; i < count; i++) {
         elements[i] = (uint32_t)buffer[i*4] | 
                      ((uint32_t)buffer[i*4+1] << 8) | 
                      ((uint32_t)buffer[i*4+2] << 16) | 
@@ -369,13 +569,14 @@ void print_buffer_stats(uint8_t* buffer, uint32_t* elements) {
 }
 
 // Check for pattern (even or odd)
-void check_pattern(uint32_t* elements) {
+void check_pattern(uint32_t* elements, int count) {
     int i;
     int even_count = 0;
     int odd_count = 0;
+    int checked = count < 10 ? count : 10;
     
     // Check first 10 elements
-    for (i = 0; i < 10; i++) {
+    for (i = 0; i < checked; i++) {
         if (elements[i] % 2 == 0) {
             even_count++;
         } else {
@@ -383,20 +584,519 @@ void check_pattern(uint32_t* elements) {
         }
     }
     
-    if (even_count == 10) {
+    if (even_count == checked) {
         printf("Detected EVEN number sequence (Buffer A)\n");
-    } else if (odd_count == 10) {
+    } else if (odd_count == checked) {
         printf("Detected ODD number sequence (Buffer B)\n");
     } else {
         printf("WARNING: Received data does not match expected pattern\n");
         printf("First 20 values mod 2: ");
-        for (i = 0; i < 20; i++) {
+        for (i = 0; i < 20 && i < count; i++) {
             printf("%d ", elements[i] % 2);
         }
         printf("\n");
     }
 }
 
+// Read little-endian values from the byte stream
+static uint16_t read_le16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Write little-endian values to a byte stream
+static void write_le16(uint8_t* p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void write_le32(uint8_t* p, uint32_t value) {
+    write_le16(p, value & 0xFFFF);
+    write_le16(p + 2, value >> 16);
+}
+
+// Find the first sync word in the buffer, returning len if there is none
+size_t find_sync_word(const uint8_t* buffer, size_t len, uint32_t sync) {
+    const uint8_t b0 = sync & 0xFF;
+    const uint8_t b1 = (sync >> 8) & 0xFF;
+    size_t i = 0;
+    size_t j;
+    
+    if (len < 4) {
+        return len;
+    }
+    
+    // Test 16 candidate offsets at once against the first two sync bytes,
+    // then confirm the full word only where a candidate survives
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint8x16_t v_b0 = vdupq_n_u8(b0);
+    uint8x16_t v_b1 = vdupq_n_u8(b1);
+    for (; i + 17 <= len; i += 16) {
+        uint8x16_t hits = vandq_u8(vceqq_u8(vld1q_u8(buffer + i), v_b0),
+                                   vceqq_u8(vld1q_u8(buffer + i + 1), v_b1));
+        uint64x2_t lanes = vreinterpretq_u64_u8(hits);
+        if ((vgetq_lane_u64(lanes, 0) | vgetq_lane_u64(lanes, 1)) == 0) {
+            continue;
+        }
+        for (j = i; j < i + 16 && j + 4 <= len; j++) {
+            if (read_le32(buffer + j) == sync) {
+                return j;
+            }
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i v_b0 = _mm_set1_epi8((char)b0);
+    __m128i v_b1 = _mm_set1_epi8((char)b1);
+    for (; i + 17 <= len; i += 16) {
+        __m128i hits = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buffer + i)), v_b0),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buffer + i + 1)), v_b1));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+        while (mask) {
+            j = i + __builtin_ctz(mask);
+            if (j + 4 <= len && read_le32(buffer + j) == sync) {
+                return j;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    
+    // Scalar tail (and fallback when no SIMD unit is available)
+    for (; i + 4 <= len; i++) {
+        if (buffer[i] == b0 && read_le32(buffer + i) == sync) {
+            return i;
+        }
+    }
+    return len;
+}
+
+// Rotate-and-add checksum over the header fields and payload
+uint32_t frame_checksum(uint16_t seq, uint16_t count, const uint32_t* elements) {
+    uint32_t sum = FRAME_SYNC_WORD ^ (((uint32_t)count << 16) | seq);
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        sum = ((sum << 1) | (sum >> 31)) + elements[i];
+    }
+    return sum;
+}
+
+// Track a frame that needs to be retransmitted (caller checks for room)
+static void add_missing(struct frame_stats* stats, uint16_t seq) {
+    stats->missing[stats->missing_count] = seq;
+    stats->missing_tries[stats->missing_count] = 0;
+    stats->missing_count++;
+    
+    stats->requested[stats->requested_next] = seq;
+    stats->requested_next = (stats->requested_next + 1) % RETX_WINDOW;
+    if (stats->requested_count < RETX_WINDOW) {
+        stats->requested_count++;
+    }
+}
+
+static int was_requested(struct frame_stats* stats, uint16_t seq) {
+    int i;
+    
+    for (i = 0; i < stats->requested_count; i++) {
+        if (stats->requested[i] == seq) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int remove_missing(struct frame_stats* stats, uint16_t seq) {
+    int i;
+    
+    for (i = 0; i < stats->missing_count; i++) {
+        if (stats->missing[i] == seq) {
+            stats->missing_count--;
+            memmove(&stats->missing[i], &stats->missing[i + 1],
+                    (stats->missing_count - i) * sizeof(stats->missing[0]));
+            memmove(&stats->missing_tries[i], &stats->missing_tries[i + 1],
+                    (stats->missing_count - i) * sizeof(stats->missing_tries[0]));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Extract every complete frame from the stream buffer, skipping slipped bytes.
+// Accepted payloads are written to outfile; the last one is left in elements.
+// Any trailing partial frame is moved to the front of the stream buffer.
+int process_frames(uint8_t* stream, size_t* stream_len, uint32_t* elements,
+                   FILE* outfile, struct frame_stats* stats) {
+    static uint32_t payload[FRAME_MAX_ELEMS];
+    size_t pos = 0;
+    int frames = 0;
+    
+    while (1) {
+        size_t avail = *stream_len - pos;
+        size_t offset = find_sync_word(stream + pos, avail, FRAME_SYNC_WORD);
+        
+        if (offset == avail) {
+            // No sync word - keep the last 3 bytes in case one straddles transfers
+            size_t keep = avail < 3 ? avail : 3;
+            stats->pending_discard += avail - keep;
+            stats->discarded_bytes += avail - keep;
+            pos += avail - keep;
+            break;
+        }
+        stats->pending_discard += offset;
+        stats->discarded_bytes += offset;
+        pos += offset;
+        
+        if (*stream_len - pos < FRAME_HEADER_BYTES) {
+            break;
+        }
+        
+        uint16_t seq = read_le16(stream + pos + 4);
+        uint16_t count = read_le16(stream + pos + 6);
+        if (count == 0 || count > FRAME_MAX_ELEMS) {
+            // Sync word appeared inside payload data; step past it and keep looking
+            stats->pending_discard++;
+            stats->discarded_bytes++;
+            pos++;
+            continue;
+        }
+        
+        size_t frame_bytes = FRAME_HEADER_BYTES + (size_t)count * BYTES_PER_ELEM + FRAME_TRAILER_BYTES;
+        if (*stream_len - pos < frame_bytes) {
+            break;
+        }
+        
+        // Decode into scratch space so a rejected frame never overwrites the last good one
+        convert_to_elements(stream + pos + FRAME_HEADER_BYTES, payload, count);
+        if (read_le32(stream + pos + frame_bytes - FRAME_TRAILER_BYTES) !=
+            frame_checksum(seq, count, payload)) {
+            // The first rejected frame marks where the stream lost alignment; the
+            // next frame should have followed it directly
+            if (!stats->bad_since_good) {
+                stats->expected_start = stats->stream_base + pos + frame_bytes;
+                stats->have_expected = 1;
+                stats->bad_since_good = 1;
+            }
+            stats->bad_frames++;
+            stats->pending_discard++;
+            stats->discarded_bytes++;
+            pos++;
+            continue;
+        }
+        
+        // Good frame - report the slip if we had to realign to get here
+        uint64_t frame_start = stats->stream_base + pos;
+        if (stats->pending_discard > 0) {
+            if (stats->have_expected) {
+                long long slip = (long long)(frame_start - stats->expected_start);
+                stats->resyncs++;
+                stats->slipped_bytes += slip < 0 ? -slip : slip;
+                printf("RESYNC: realigned at frame %u, stream slipped %+lld bytes (%lu bytes discarded)\n",
+                       seq, slip, stats->pending_discard);
+            } else {
+                printf("Locked on at frame %u after %lu bytes discarded\n",
+                       seq, stats->pending_discard);
+            }
+            stats->pending_discard = 0;
+        }
+        stats->expected_start = frame_start + frame_bytes;
+        stats->have_expected = 1;
+        stats->bad_since_good = 0;
+        int16_t ahead = (int16_t)(seq - stats->last_seq);
+        int older = stats->have_seq && ahead <= 0;
+        if (older && remove_missing(stats, seq)) {
+            stats->recovered++;
+            printf("Recovered frame %u by retransmission\n", seq);
+        } else if (older && (ahead == 0 || (ahead > -RETX_WINDOW && was_requested(stats, seq)))) {
+            // A repeat of the last frame, or a retransmission we no longer needed
+            stats->duplicates++;
+            pos += frame_bytes;
+            continue;
+        } else {
+            if (older) {
+                // Never asked for, so not a retransmission - the device restarted its
+                // numbering. (A restart that lands ahead of last_seq looks like a gap.)
+                printf("WARNING: sequence went back from %u to %u without a retransmit request, "
+                       "restarting sequence tracking\n", stats->last_seq, seq);
+                stats->lost_frames += stats->missing_count;
+                stats->missing_count = 0;
+                stats->requested_count = 0;
+                stats->have_seq = 0;
+            }
+            if (stats->have_seq && ahead > 1) {
+                // Only frames still in the device's history can be resent; if the
+                // list is short on room, ask for the newest ones
+                int gap = ahead - 1;
+                int queued = gap < RETX_WINDOW ? gap : RETX_WINDOW - 1;
+                if (queued > MAX_MISSING - stats->missing_count) {
+                    queued = MAX_MISSING - stats->missing_count;
+                }
+                for (uint16_t gap_seq = seq - queued; gap_seq != seq; gap_seq++) {
+                    add_missing(stats, gap_seq);
+                }
+                stats->lost_frames += gap - queued;
+                printf("WARNING: %d frames missing before frame %u, requesting retransmit of %d (%d lost)\n",
+                       gap, seq, queued, gap - queued);
+            }
+            stats->have_seq = 1;
+            stats->last_seq = seq;
+            stats->current_elems = count;
+        }
+        memcpy(elements, payload, count * sizeof(uint32_t));
+        stats->last_count = count;
+        stats->frames++;
+        frames++;
+        
+        // Each record is sequence (2), element count (2), payload, so retransmitted
+        // frames can be put back in order afterwards
+        if (outfile) {
+            uint16_t record[2] = { seq, count };
+            fwrite(record, sizeof(uint16_t), 2, outfile);
+            fwrite(elements, sizeof(uint32_t), count, outfile);
+        }
+        pos += frame_bytes;
+    }
+    
+    // Carry the unconsumed tail over to the next transfer
+    memmove(stream, stream + pos, *stream_len - pos);
+    *stream_len -= pos;
+    stats->stream_base += pos;
+    return frames;
+}
+
+// Append one command to the tx buffer, returning the new length
+static int put_command(uint8_t* commands, int length, uint16_t opcode, uint16_t seq, uint16_t arg) {
+    if (length + CMD_BYTES > CHUNK_SIZE) {
+        return length;
+    }
+    write_le32(commands + length, CMD_SYNC_WORD);
+    write_le16(commands + length + 4, opcode);
+    write_le16(commands + length + 6, seq);
+    write_le16(commands + length + 8, arg);
+    write_le16(commands + length + 10, opcode ^ seq ^ arg ^ 0x5AA5);
+    return length + CMD_BYTES;
+}
+
+// Build this transfer's commands: an acknowledgement, retransmit requests for
+// missing frames (consecutive frames merged into one request) and any pending
+// frame size change. Returns the number of command bytes.
+int build_commands(uint8_t* commands, struct frame_stats* stats) {
+    int length = 0;
+    int i = 0;
+    
+    if (!stats->have_seq) {
+        return 0;
+    }
+    
+    // Give up on frames that have already been requested too often
+    while (i < stats->missing_count) {
+        if (stats->missing_tries[i] >= RETX_MAX_TRIES) {
+            printf("WARNING: giving up on frame %u\n", stats->missing[i]);
+            stats->lost_frames++;
+            remove_missing(stats, stats->missing[i]);
+        } else {
+            i++;
+        }
+    }
+    
+    // Acknowledge everything before the oldest frame still missing
+    uint16_t ack = stats->last_seq;
+    for (i = 0; i < stats->missing_count; i++) {
+        if ((int16_t)(stats->missing[i] - 1 - ack) < 0) {
+            ack = stats->missing[i] - 1;
+        }
+    }
+    length = put_command(commands, length, CMD_ACK, ack, 0);
+    
+    // Leave room for a frame size command
+    i = 0;
+    while (i < stats->missing_count && length + 2 * CMD_BYTES <= CHUNK_SIZE) {
+        uint16_t first = stats->missing[i];
+        uint16_t run = 1;
+        while (i + run < stats->missing_count && stats->missing[i + run] == (uint16_t)(first + run)) {
+            run++;
+        }
+        length = put_command(commands, length, CMD_RETRANSMIT, first, run);
+        
+        // Only frames actually requested count towards giving up
+        for (; run > 0; run--, i++) {
+            stats->missing_tries[i]++;
+        }
+    }
+    
+    if (stats->requested_elems > 0 && stats->requested_elems != stats->current_elems) {
+        length = put_command(commands, length, CMD_FRAME_SIZE, 0, stats->requested_elems);
+    }
+    return length;
+}
+
+// Double the frame size after a clean transfer, halve it after errors
+void adjust_frame_size(struct frame_stats* stats, int link_ok) {
+    int elems = stats->current_elems;
+    
+    // Wait for the device to apply the previous request before growing again
+    if (elems == 0 || (stats->requested_elems > 0 && link_ok &&
+                       stats->requested_elems != stats->current_elems)) {
+        return;
+    }
+    
+    if (link_ok) {
+        elems = elems * 2 > FRAME_FIT_ELEMS ? FRAME_FIT_ELEMS : elems * 2;
+    } else {
+        elems = elems / 2 < FRAME_MIN_ELEMS ? FRAME_MIN_ELEMS : elems / 2;
+    }
+    
+    if (elems != stats->current_elems && elems != stats->requested_elems) {
+        printf("Requesting %d-element frames (link %s)\n", elems, link_ok ? "clean" : "noisy");
+    }
+    stats->requested_elems = elems;
+}
+
+// Simulated device payload: even values on even frames, odd on odd frames,
+// like the Teensy's Buffer A / Buffer B pattern
+static uint32_t sim_element(uint16_t seq, int index) {
+    return (((uint32_t)seq << 13) + index) * 2 + (seq & 1);
+}
+
+// Encode one frame into the simulated device's output buffer
+static void sim_build_frame(uint16_t seq, int count) {
+    static uint32_t payload[FRAME_MAX_ELEMS];
+    int i;
+    
+    write_le32(sim.frame, FRAME_SYNC_WORD);
+    write_le16(sim.frame + 4, seq);
+    write_le16(sim.frame + 6, count);
+    for (i = 0; i < count; i++) {
+        payload[i] = sim_element(seq, i);
+        write_le32(sim.frame + FRAME_HEADER_BYTES + i * BYTES_PER_ELEM, payload[i]);
+    }
+    write_le32(sim.frame + FRAME_HEADER_BYTES + count * BYTES_PER_ELEM,
+               frame_checksum(seq, count, payload));
+    sim.frame_len = FRAME_HEADER_BYTES + count * BYTES_PER_ELEM + FRAME_TRAILER_BYTES;
+    sim.frame_pos = 0;
+}
+
+// Start the next frame: queued retransmissions first, then new data
+static void sim_next_frame(void) {
+    if (sim.retx_count > 0) {
+        uint16_t seq = sim.retx_queue[0];
+        sim.retx_count--;
+        memmove(&sim.retx_queue[0], &sim.retx_queue[1], sim.retx_count * sizeof(sim.retx_queue[0]));
+        sim_build_frame(seq, sim.history_elems[seq % SIM_HISTORY_FRAMES]);
+        return;
+    }
+    sim.history_elems[sim.next_seq % SIM_HISTORY_FRAMES] = sim.frame_elems;
+    sim_build_frame(sim.next_seq, sim.frame_elems);
+    sim.next_seq++;
+}
+
+// Queue a retransmission if the frame is unacknowledged and still in history
+static void sim_queue_retransmit(uint16_t seq) {
+    uint16_t age = (uint16_t)(sim.next_seq - seq);
+    int i;
+    
+    if (age == 0 || age > SIM_HISTORY_FRAMES || sim.retx_count == SIM_MAX_RETX) {
+        return;
+    }
+    if (sim.have_ack && (int16_t)(seq - sim.acked_seq) <= 0) {
+        return;
+    }
+    for (i = 0; i < sim.retx_count; i++) {
+        if (sim.retx_queue[i] == seq) {
+            return;
+        }
+    }
+    sim.retx_queue[sim.retx_count++] = seq;
+}
+
+// Decode the host commands found in the tx half of a transfer
+static void sim_parse_commands(const uint8_t* tx, size_t len) {
+    size_t pos = 0;
+    
+    while (pos < len) {
+        pos += find_sync_word(tx + pos, len - pos, CMD_SYNC_WORD);
+        if (pos + CMD_BYTES > len) {
+            return;
+        }
+        
+        uint16_t opcode = read_le16(tx + pos + 4);
+        uint16_t seq = read_le16(tx + pos + 6);
+        uint16_t arg = read_le16(tx + pos + 8);
+        if (read_le16(tx + pos + 10) != (opcode ^ seq ^ arg ^ 0x5AA5)) {
+            pos++;
+            continue;
+        }
+        
+        switch (opcode) {
+        case CMD_ACK:
+            sim.acked_seq = seq;
+            sim.have_ack = 1;
+            break;
+        case CMD_RETRANSMIT:
+            printf("SIM: retransmitting %u frames from %u\n", arg, seq);
+            for (uint16_t k = 0; k < arg; k++) {
+                sim_queue_retransmit(seq + k);
+            }
+            break;
+        case CMD_FRAME_SIZE:
+            if (arg >= FRAME_MIN_ELEMS && arg <= FRAME_MAX_ELEMS) {
+                sim.frame_elems = arg;
+                printf("SIM: frame size now %u elements\n", arg);
+            }
+            break;
+        }
+        pos += CMD_BYTES;
+    }
+}
+
+// Reset the simulated device
+void sim_device_init(void) {
+    memset(&sim, 0, sizeof(sim));
+    sim.frame_elems = SIM_DEFAULT_ELEMS;
+    sim.frame_len = 0;
+    sim.frame_pos = 0;
+}
+
+// Clock len bytes out of the simulated device while it reads the host's tx bytes
+int sim_device_transfer(const uint8_t* tx, uint8_t* rx, size_t len) {
+    size_t i;
+    
+    for (i = 0; i < len; i++) {
+        if (sim.frame_pos == sim.frame_len) {
+            sim_next_frame();
+        }
+        
+        // Periodically drop, insert or corrupt a byte on the wire
+        if (++sim.byte_count % SIM_GLITCH_BYTES == 0) {
+            switch (sim.glitch++ % 3) {
+            case 0:
+                sim.frame_pos++;
+                if (sim.frame_pos == sim.frame_len) {
+                    sim_next_frame();
+                }
+                break;
+            case 1:
+                rx[i] = 0xFF;
+                continue;
+            case 2:
+                rx[i] = sim.frame[sim.frame_pos++] ^ 0x10;
+                continue;
+            }
+        }
+        rx[i] = sim.frame[sim.frame_pos++];
+    }
+    
+    // Commands take effect after the bytes already on the wire
+    if (tx) {
+        sim_parse_commands(tx, len);
+    }
+    return (int)len;
+}
+
 // Calculate time difference in milliseconds
 double get_time_diff_ms(struct timespec start, struct timespec end) {
     return ((end.tv_sec - start.tv_sec) * 1000.0) + 